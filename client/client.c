@@ -4,31 +4,464 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <sys/stat.h>
+#include <ctype.h>
 
 #define PORT 8080
 #define BUFFER_SIZE 1024
+#define ROOM_NAME_LEN 30
+#define MAX_TRACKED_ROOMS 8
+#define XFER_CHUNK 16384       // Must not exceed the server's XFER_CHUNK
+#define XFER_NAME_LEN 64
+#define MAX_DOWNLOADS 8
+
+/* Last sequence number seen per room, for gap detection */
+typedef struct {
+    char room[ROOM_NAME_LEN];
+    unsigned long last_seq;
+} RoomSeq;
+
+/* Outgoing upload (one at a time). The server grants a window and
+ * acknowledges chunks; we never have more than `window` bytes unacked. */
+typedef struct {
+    int active;
+    int aborted;
+    unsigned long id;       // 0 until the server accepts the upload
+    FILE *file;
+    char name[XFER_NAME_LEN];
+    long long size;
+    long long sent;
+    long long acked;
+    long long window;
+} Upload;
+
+/* Incoming file being streamed to us. A long chat message ("text" for
+ * the room, "pm" for us only) is buffered and printed when complete. */
+typedef struct {
+    unsigned long id;
+    FILE *file;
+    char kind[8];
+    char from[50];
+    char path[XFER_NAME_LEN + 32];
+    long long size;
+    long long received;
+} Download;
 
 int sockfd;
 char username[50];
+RoomSeq room_seqs[MAX_TRACKED_ROOMS];
+int room_seq_count = 0;
+pthread_mutex_t seq_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+Upload upload;
+pthread_mutex_t upload_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t upload_cond = PTHREAD_COND_INITIALIZER;
+Download downloads[MAX_DOWNLOADS];  // Only touched by the receive thread
+Download *data_target = NULL;
+size_t data_remaining = 0;
 
-/* Thread to receive messages */
-void *receive_messages(void *arg) {
+/* Send a complete frame; the main, receive and upload threads all write
+ * to the socket, so frames must not interleave */
+int send_frame(const char *data, size_t len) {
+    pthread_mutex_lock(&send_lock);
+    while (len > 0) {
+        ssize_t sent = send(sockfd, data, len, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            pthread_mutex_unlock(&send_lock);
+            return 0;
+        }
+        data += sent;
+        len -= sent;
+    }
+    pthread_mutex_unlock(&send_lock);
+    return 1;
+}
+
+/* Forget sequence state (e.g. when switching rooms) */
+void reset_room_seqs(void) {
+    pthread_mutex_lock(&seq_lock);
+    room_seq_count = 0;
+    pthread_mutex_unlock(&seq_lock);
+}
+
+/* Record a room sequence number; ask the server to resend if we skipped any */
+void track_seq(const char *room, unsigned long seq) {
+    unsigned long missing_from = 0;
+    unsigned long missing_to = 0;
+
+    pthread_mutex_lock(&seq_lock);
+    RoomSeq *entry = NULL;
+    for (int i = 0; i < room_seq_count; i++) {
+        if (strcmp(room_seqs[i].room, room) == 0) {
+            entry = &room_seqs[i];
+            break;
+        }
+    }
+    if (!entry) {
+        /* First message seen in this room: start tracking from here */
+        entry = &room_seqs[room_seq_count < MAX_TRACKED_ROOMS ? room_seq_count++ : 0];
+        strncpy(entry->room, room, ROOM_NAME_LEN - 1);
+        entry->room[ROOM_NAME_LEN - 1] = '\0';
+        entry->last_seq = seq;
+    } else if (seq > entry->last_seq) {
+        if (seq > entry->last_seq + 1) {
+            missing_from = entry->last_seq + 1;
+            missing_to = seq - 1;
+        }
+        entry->last_seq = seq;
+    }
+    pthread_mutex_unlock(&seq_lock);
+
+    if (missing_from) {
+        char request[BUFFER_SIZE];
+        snprintf(request, sizeof(request), "/resend %s %lu %lu\n", room, missing_from, missing_to);
+        send_frame(request, strlen(request));
+    }
+}
+
+/* Upload thread: stream the file in chunks within the server's window */
+void *upload_file(void *arg) {
     (void)arg;  // Argument not used
+    char frame[XFER_CHUNK + 64];
+
+    pthread_mutex_lock(&upload_lock);
+    while (!upload.id && !upload.aborted) {
+        pthread_cond_wait(&upload_cond, &upload_lock);
+    }
+    pthread_mutex_unlock(&upload_lock);
+
+    for (;;) {
+        pthread_mutex_lock(&upload_lock);
+        long long remaining = upload.size - upload.sent;
+        size_t len = remaining < XFER_CHUNK ? (size_t)remaining : XFER_CHUNK;
+        while (!upload.aborted && upload.sent + (long long)len - upload.acked > upload.window) {
+            pthread_cond_wait(&upload_cond, &upload_lock);
+        }
+        int stop = upload.aborted || len == 0;
+        pthread_mutex_unlock(&upload_lock);
+        if (stop) {
+            break;
+        }
+
+        int header = snprintf(frame, sizeof(frame), "/chunk %lu %zu\n", upload.id, len);
+        if (fread(frame + header, 1, len, upload.file) != len) {
+            /* Local failure: tell the server so it frees the transfer */
+            snprintf(frame, sizeof(frame), "/cancel %lu\n", upload.id);
+            send_frame(frame, strlen(frame));
+            pthread_mutex_lock(&upload_lock);
+            upload.aborted = 1;
+            pthread_mutex_unlock(&upload_lock);
+            break;
+        }
+        if (!send_frame(frame, header + len)) {
+            pthread_mutex_lock(&upload_lock);
+            upload.aborted = 1;
+            pthread_mutex_unlock(&upload_lock);
+            break;
+        }
+
+        pthread_mutex_lock(&upload_lock);
+        upload.sent += len;
+        pthread_mutex_unlock(&upload_lock);
+    }
+
+    /* Wait for the final acknowledgement */
+    pthread_mutex_lock(&upload_lock);
+    while (!upload.aborted && upload.acked < upload.size) {
+        pthread_cond_wait(&upload_cond, &upload_lock);
+    }
+    if (upload.aborted) {
+        printf("[Upload of %s failed]\n", upload.name);
+    } else {
+        printf("[Upload of %s complete]\n", upload.name);
+    }
+    fflush(stdout);
+    fclose(upload.file);
+    upload.active = 0;
+    pthread_mutex_unlock(&upload_lock);
+    return NULL;
+}
+
+/* Begin uploading an open file to the current room under the given
+ * name; takes ownership of file. options ("text" or "text <user>")
+ * marks a long chat message, or NULL for a plain file. */
+void start_upload(FILE *file, const char *name, const char *options) {
+    pthread_mutex_lock(&upload_lock);
+    if (upload.active) {
+        pthread_mutex_unlock(&upload_lock);
+        fclose(file);
+        printf("[An upload is already in progress]\n");
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fileno(file), &st) < 0 || st.st_size == 0) {
+        pthread_mutex_unlock(&upload_lock);
+        fclose(file);
+        printf("[Cannot upload %s]\n", name);
+        return;
+    }
+
+    memset(&upload, 0, sizeof(upload));
+    strncpy(upload.name, name, sizeof(upload.name) - 1);
+    for (char *p = upload.name; *p; p++) {
+        if (*p == ' ') {
+            *p = '_';
+        }
+    }
+    upload.file = file;
+    upload.size = st.st_size;
+    upload.active = 1;
+    pthread_mutex_unlock(&upload_lock);
+
+    char request[BUFFER_SIZE];
+    snprintf(request, sizeof(request), "/upload %s %lld%s%s\n", upload.name, upload.size,
+             options ? " " : "", options ? options : "");
+    send_frame(request, strlen(request));
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, upload_file, NULL);
+    pthread_detach(tid);
+}
+
+Download *find_download(unsigned long id) {
+    for (int i = 0; i < MAX_DOWNLOADS; i++) {
+        if (downloads[i].file && downloads[i].id == id) {
+            return &downloads[i];
+        }
+    }
+    return NULL;
+}
+
+/* Send a message too long for one line as a text transfer; target is
+ * the recipient of a private message, or NULL for the current room */
+void send_long_text(const char *text, const char *target) {
+    FILE *file = tmpfile();
+    if (!file || fputs(text, file) == EOF || fflush(file) != 0) {
+        if (file) {
+            fclose(file);
+        }
+        printf("[Message too long to send]\n");
+        return;
+    }
+    rewind(file);
+
+    char options[64];
+    snprintf(options, sizeof(options), target ? "text %s" : "text", target);
+    start_upload(file, "message.txt", options);
+}
+
+/* Tell the server to stop streaming a download we can't take */
+void cancel_download(unsigned long id) {
+    char request[64];
+    snprintf(request, sizeof(request), "/cancel %lu\n", id);
+    send_frame(request, strlen(request));
+}
+
+/* "@file <id> <name> <size> [text|pm <from>]": a shared file or long
+ * message is about to be streamed */
+void start_download(unsigned long id, const char *name, long long size,
+                    const char *kind, const char *from) {
+    for (int i = 0; i < MAX_DOWNLOADS; i++) {
+        Download *dl = &downloads[i];
+        if (!dl->file) {
+            if (kind[0]) {
+                snprintf(dl->path, sizeof(dl->path), "%s", name);
+                dl->file = tmpfile();
+            } else {
+                snprintf(dl->path, sizeof(dl->path), "download_%lu_%s", id, name);
+                dl->file = fopen(dl->path, "wb");
+            }
+            if (!dl->file) {
+                printf("[Cannot save %s]\n", dl->path);
+                cancel_download(id);
+                return;
+            }
+            dl->id = id;
+            dl->size = size;
+            dl->received = 0;
+            strncpy(dl->kind, kind, sizeof(dl->kind) - 1);
+            dl->kind[sizeof(dl->kind) - 1] = '\0';
+            strncpy(dl->from, from, sizeof(dl->from) - 1);
+            dl->from[sizeof(dl->from) - 1] = '\0';
+            if (!kind[0]) {
+                printf("[Receiving %s (%lld bytes)]\n", dl->path, size);
+            }
+            return;
+        }
+    }
+    printf("[Too many downloads, skipping %s]\n", name);
+    cancel_download(id);
+}
+
+/* Show a completed long message inline, like an ordinary chat line */
+void print_long_text(Download *dl) {
     char buffer[BUFFER_SIZE];
-    int bytes;
+    size_t len;
+    int last = '\n';
 
-    while ((bytes = recv(sockfd, buffer, BUFFER_SIZE, 0)) > 0) {
-        buffer[bytes] = '\0';
-        printf("%s", buffer);
+    if (strcmp(dl->kind, "pm") == 0) {
+        printf("[PM from %s]: ", dl->from);
+    } else {
+        printf("%s: ", dl->from);
+    }
+    rewind(dl->file);
+    while ((len = fread(buffer, 1, sizeof(buffer), dl->file)) > 0) {
+        fwrite(buffer, 1, len, stdout);
+        last = buffer[len - 1];
+    }
+    if (last != '\n') {
+        printf("\n");
+    }
+}
+
+/* Store raw "@data" payload bytes */
+void download_write(const char *data, size_t len) {
+    Download *dl = data_target;
+    if (!dl) {
+        return;  // Unknown transfer: discard
+    }
+
+    fwrite(data, 1, len, dl->file);
+    dl->received += len;
+    if (dl->received >= dl->size) {
+        if (dl->kind[0]) {
+            print_long_text(dl);
+        } else {
+            printf("[Download complete: %s]\n", dl->path);
+        }
+        fclose(dl->file);
+        dl->file = NULL;
+        data_target = NULL;
         fflush(stdout);
     }
+}
+
+/* Does the line start with the server's "[HH:MM:SS] " timestamp? */
+int is_room_timestamp(const char *line) {
+    const char *pattern = "[00:00:00] ";
+    for (int i = 0; pattern[i]; i++) {
+        if (pattern[i] == '0' ? !isdigit((unsigned char)line[i]) : line[i] != pattern[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Handle one complete line from the server */
+void handle_line(const char *line) {
+    char room[ROOM_NAME_LEN];
+    unsigned long seq;
+
+    char name[XFER_NAME_LEN];
+    char kind[8];
+    char from[50];
+    unsigned long id;
+    long long value;
+    size_t len;
+
+    /* Control lines start with '@' and are never displayed */
+    if (line[0] == '@') {
+        if (sscanf(line, "@seq %29s %lu", room, &seq) == 2) {
+            /* Our own message's sequence number */
+            track_seq(room, seq);
+        } else if (sscanf(line, "@data %lu %zu", &id, &len) == 2) {
+            data_target = find_download(id);
+            data_remaining = len;
+        } else if (sscanf(line, "@file %lu %63s %lld", &id, name, &value) == 3) {
+            kind[0] = '\0';
+            from[0] = '\0';
+            sscanf(line, "@file %*s %*s %*s %7s %49s", kind, from);
+            start_download(id, name, value, kind, from);
+        } else if (sscanf(line, "@upload %lu %lld", &id, &value) == 2) {
+            pthread_mutex_lock(&upload_lock);
+            upload.id = id;
+            upload.window = value;
+            pthread_cond_broadcast(&upload_cond);
+            pthread_mutex_unlock(&upload_lock);
+        } else if (sscanf(line, "@ack %lu %lld", &id, &value) == 2) {
+            pthread_mutex_lock(&upload_lock);
+            if (upload.active && upload.id == id) {
+                upload.acked = value;
+                pthread_cond_broadcast(&upload_cond);
+            }
+            pthread_mutex_unlock(&upload_lock);
+        } else if (sscanf(line, "@abort %lu", &id) == 1) {
+            pthread_mutex_lock(&upload_lock);
+            if (upload.active && upload.id == id) {
+                upload.aborted = 1;
+                pthread_cond_broadcast(&upload_cond);
+            }
+            pthread_mutex_unlock(&upload_lock);
+        }
+        return;
+    }
+
+    /* Room messages look like "[HH:MM:SS] [#room:seq] ...". Only the tag
+     * right after the timestamp counts; message text can't spoof it. */
+    if (is_room_timestamp(line) && sscanf(line + 11, "[#%29[^:]:%lu]", room, &seq) == 2) {
+        track_seq(room, seq);
+    }
+
+    printf("%s", line);
+    fflush(stdout);
+}
+
+/* Thread to receive messages: newline-framed lines, plus the raw
+ * payload that follows each "@data" line */
+void *receive_messages(void *arg) {
+    (void)arg;  // Argument not used
+    char buffer[XFER_CHUNK + BUFFER_SIZE];
+    size_t used = 0;
+    int bytes;
+
+    while ((bytes = recv(sockfd, buffer + used, sizeof(buffer) - used - 1, 0)) > 0) {
+        used += bytes;
+
+        size_t pos = 0;
+        while (pos < used) {
+            if (data_remaining > 0) {
+                size_t len = used - pos < data_remaining ? used - pos : data_remaining;
+                download_write(buffer + pos, len);
+                data_remaining -= len;
+                pos += len;
+
+                /* Frame done: acknowledge so the server can send more */
+                if (data_remaining == 0 && data_target) {
+                    char ack[64];
+                    snprintf(ack, sizeof(ack), "/dlack %lu %lld\n", data_target->id, data_target->received);
+                    send_frame(ack, strlen(ack));
+                }
+                continue;
+            }
+
+            char *newline = memchr(buffer + pos, '\n', used - pos);
+            if (!newline) {
+                break;
+            }
+            char saved = newline[1];
+            newline[1] = '\0';
+            handle_line(buffer + pos);
+            newline[1] = saved;
+            pos = newline + 1 - buffer;
+        }
+
+        used -= pos;
+        memmove(buffer, buffer + pos, used);
+
+        /* Line longer than the buffer: print what we have */
+        if (used == sizeof(buffer) - 1) {
+            buffer[used] = '\0';
+            printf("%s", buffer);
+            used = 0;
+        }
+    }
     return NULL;
 }
 
 int main() {
     struct sockaddr_in server_addr;
     pthread_t recv_thread;
-    char message[BUFFER_SIZE];
     char final_msg[BUFFER_SIZE];
     char password[50];
 
@@ -61,38 +494,68 @@ int main() {
     /* Send username and password for authentication */
     char auth_username[BUFFER_SIZE];
     char auth_password[BUFFER_SIZE];
-    char auth_response[BUFFER_SIZE];
+    char auth_response[8];
     snprintf(auth_username, sizeof(auth_username), "%s\n", username);
     snprintf(auth_password, sizeof(auth_password), "%s\n", password);
     send(sockfd, auth_username, strlen(auth_username), 0);
     send(sockfd, auth_password, strlen(auth_password), 0);
     
-    /* Wait for authentication response */
-    int bytes = recv(sockfd, auth_response, sizeof(auth_response) - 1, 0);
+    /* Wait for authentication response. Peek only, so the receive
+     * thread sees the welcome banner and everything after it intact. */
+    int bytes = recv(sockfd, auth_response, sizeof(auth_response) - 1, MSG_PEEK);
     if (bytes > 0) {
         auth_response[bytes] = '\0';
         if (strncmp(auth_response, "ERROR:", 6) == 0) {
-            printf("%s", auth_response);
+            char error[BUFFER_SIZE];
+            bytes = recv(sockfd, error, sizeof(error) - 1, 0);
+            error[bytes > 0 ? bytes : 0] = '\0';
+            printf("%s", error);
             close(sockfd);
             exit(1);
         }
-        /* Print welcome banner */
-        printf("%s", auth_response);
     }
 
     pthread_create(&recv_thread, NULL, receive_messages, NULL);
 
-    while (1) {
-        fgets(message, BUFFER_SIZE, stdin);
+    char *message = NULL;
+    size_t message_cap = 0;
+    while (getline(&message, &message_cap, stdin) > 0) {
         
         /* Check if it's a command */
-        if (message[0] == '/') {
-            send(sockfd, message, strlen(message), 0);
-        } else {
+        if (strncmp(message, "/upload ", 8) == 0) {
+            message[strcspn(message, "\n")] = 0;
+            FILE *file = fopen(message + 8, "rb");
+            if (!file) {
+                printf("[Cannot upload %s]\n", message + 8);
+                continue;
+            }
+            const char *base = strrchr(message + 8, '/');
+            start_upload(file, base ? base + 1 : message + 8, NULL);
+        } else if (message[0] == '/') {
+            if (strlen(message) >= BUFFER_SIZE) {
+                /* A long private message goes as a text transfer too */
+                char target[50];
+                int offset = 0;
+                if (sscanf(message, "/pm %49s %n", target, &offset) == 1 && offset > 0) {
+                    send_long_text(message + offset, target);
+                } else {
+                    printf("[Command too long]\n");
+                }
+                continue;
+            }
+            if (strncmp(message, "/join ", 6) == 0) {
+                reset_room_seqs();
+            }
+            send_frame(message, strlen(message));
+        } else if (strlen(username) + 2 + strlen(message) < BUFFER_SIZE) {
             snprintf(final_msg, BUFFER_SIZE, "%s: %s", username, message);
-            send(sockfd, final_msg, strlen(final_msg), 0);
+            send_frame(final_msg, strlen(final_msg));
+        } else {
+            /* Too long for one chat line: stream it as a text transfer */
+            send_long_text(message, NULL);
         }
     }
+    free(message);
 
     close(sockfd);
     return 0;
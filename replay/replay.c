@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <errno.h>
+
+#define PORT 8080
+#define BUFFER_SIZE 1024
+#define MAX_CONNS 256
+
+/* Trace format - must match server/server.c */
+#define TRACE_MAGIC "NCTRACE1"
+#define TRACE_CONNECT 1
+#define TRACE_DATA    2
+#define TRACE_CLOSE   3
+
+typedef struct {
+    uint64_t ts_ns;
+    uint32_t conn_id;
+    uint16_t len;
+    uint8_t type;
+    uint8_t reserved;
+} TraceRecord;
+
+/* One replayed connection and the thread draining its replies */
+typedef struct {
+    uint32_t conn_id;
+    int fd;
+    int active;
+    pthread_t drain_tid;
+    uint64_t bytes_received;
+} ReplayConn;
+
+ReplayConn conns[MAX_CONNS];
+int conn_count = 0;
+uint64_t total_conns = 0;
+uint64_t total_bytes_received = 0;
+
+/* Monotonic clock in nanoseconds */
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Sleep until an absolute CLOCK_MONOTONIC deadline */
+void sleep_until(uint64_t deadline_ns) {
+    struct timespec ts;
+    ts.tv_sec = deadline_ns / 1000000000ULL;
+    ts.tv_nsec = deadline_ns % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+/* Discard server output so the server never blocks on a full socket */
+void *drain_replies(void *arg) {
+    ReplayConn *conn = (ReplayConn *)arg;
+    char buffer[BUFFER_SIZE];
+    int bytes;
+
+    while ((bytes = recv(conn->fd, buffer, sizeof(buffer), 0)) > 0) {
+        conn->bytes_received += bytes;
+    }
+    return NULL;
+}
+
+ReplayConn *find_conn(uint32_t conn_id) {
+    for (int i = 0; i < conn_count; i++) {
+        if (conns[i].active && conns[i].conn_id == conn_id) {
+            return &conns[i];
+        }
+    }
+    return NULL;
+}
+
+/* Connect a new replay client to the server */
+int open_conn(uint32_t conn_id, const struct sockaddr_in *server_addr) {
+    /* Reuse a slot freed by an earlier close */
+    ReplayConn *conn = NULL;
+    for (int i = 0; i < conn_count; i++) {
+        if (!conns[i].active) {
+            conn = &conns[i];
+            break;
+        }
+    }
+    if (!conn) {
+        if (conn_count >= MAX_CONNS) {
+            fprintf(stderr, "Too many open connections in trace (max %d)\n", MAX_CONNS);
+            return 0;
+        }
+        conn = &conns[conn_count++];
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Socket failed");
+        return 0;
+    }
+    if (connect(fd, (const struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
+        perror("Connection failed");
+        close(fd);
+        return 0;
+    }
+
+    conn->conn_id = conn_id;
+    conn->fd = fd;
+    conn->active = 1;
+    conn->bytes_received = 0;
+    pthread_create(&conn->drain_tid, NULL, drain_replies, conn);
+    total_conns++;
+    return 1;
+}
+
+/* Half-close, wait for the server to finish replying, then release */
+void close_conn(ReplayConn *conn) {
+    shutdown(conn->fd, SHUT_WR);
+    pthread_join(conn->drain_tid, NULL);
+    close(conn->fd);
+    conn->active = 0;
+    total_bytes_received += conn->bytes_received;
+}
+
+/* Send the whole payload, retrying on short writes */
+int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return 0;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 1;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s <trace_file> [-s speed] [-h host] [-p port]\n", prog);
+    fprintf(stderr, "  -s speed   replay speed multiplier (1 = real time, 0 = no delays)\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *trace_path = NULL;
+    const char *host = "127.0.0.1";
+    int port = PORT;
+    double speed = 1.0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-h") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (!trace_path && argv[i][0] != '-') {
+            trace_path = argv[i];
+        } else {
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (!trace_path || speed < 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    FILE *trace = fopen(trace_path, "rb");
+    if (!trace) {
+        perror("Failed to open trace file");
+        exit(1);
+    }
+
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), trace) != sizeof(magic) ||
+        memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s is not a NetChat trace\n", trace_path);
+        fclose(trace);
+        exit(1);
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = inet_addr(host);
+
+    printf("Replaying %s against %s:%d at %gx\n", trace_path, host, port, speed);
+
+    TraceRecord rec;
+    char payload[UINT16_MAX];
+    uint64_t events = 0, bytes_sent = 0, max_lag_ns = 0;
+    uint64_t start_ns = now_ns();
+
+    while (fread(&rec, sizeof(rec), 1, trace) == 1) {
+        if (rec.len > 0 && fread(payload, 1, rec.len, trace) != rec.len) {
+            fprintf(stderr, "Truncated trace record\n");
+            break;
+        }
+
+        /* Pace events against the recorded timeline */
+        if (speed > 0) {
+            uint64_t due_ns = start_ns + (uint64_t)(rec.ts_ns / speed);
+            uint64_t t = now_ns();
+            if (t < due_ns) {
+                sleep_until(due_ns);
+            } else if (t - due_ns > max_lag_ns) {
+                max_lag_ns = t - due_ns;
+            }
+        }
+
+        ReplayConn *conn = find_conn(rec.conn_id);
+        switch (rec.type) {
+        case TRACE_CONNECT:
+            if (!conn) {
+                open_conn(rec.conn_id, &server_addr);
+            }
+            break;
+        case TRACE_DATA:
+            if (conn && send_all(conn->fd, payload, rec.len)) {
+                bytes_sent += rec.len;
+            }
+            break;
+        case TRACE_CLOSE:
+            if (conn) {
+                close_conn(conn);
+            }
+            break;
+        default:
+            fprintf(stderr, "Unknown trace record type %d\n", rec.type);
+            break;
+        }
+        events++;
+    }
+    fclose(trace);
+
+    for (int i = 0; i < conn_count; i++) {
+        if (conns[i].active) {
+            close_conn(&conns[i]);
+        }
+    }
+
+    double elapsed = (now_ns() - start_ns) / 1e9;
+    printf("Events:      %llu\n", (unsigned long long)events);
+    printf("Connections: %llu\n", (unsigned long long)total_conns);
+    printf("Bytes sent:  %llu\n", (unsigned long long)bytes_sent);
+    printf("Bytes recv:  %llu\n", (unsigned long long)total_bytes_received);
+    printf("Elapsed:     %.3f s\n", elapsed);
+    printf("Max lag:     %.3f ms\n", max_lag_ns / 1e6);
+    return 0;
+}
@@ -6,6 +6,12 @@
 #include <pthread.h>
 #include <time.h>
 #include <signal.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <dirent.h>
 
 #define PORT 8080
 #define MAX_CLIENTS 10
@@ -14,6 +20,38 @@
 #define USERS_FILE "users.txt"
 #define MAX_ROOMS 5
 #define ROOM_NAME_LEN 30
+#define ROOM_TABLE_SIZE 64
+#define ROOM_HISTORY 32
+#define OUTBOX_MAX_BYTES (256 * 1024)   // Queued text before a slow client is dropped
+#define MAX_STREAMS 2                   // Concurrent file downloads per client
+
+/* Chunked file transfer: uploads are spooled to disk, then streamed to
+ * recipients in XFER_CHUNK frames so chat traffic interleaves with them */
+#define SPOOL_DIR "spool"
+#define MAX_TRANSFERS 32
+#define XFER_CHUNK 16384
+#define XFER_WINDOW (4 * XFER_CHUNK)
+#define XFER_MAX_SIZE (1024LL * 1024 * 1024)
+#define XFER_NAME_LEN 64
+#define READ_BUFFER_SIZE (XFER_CHUNK + BUFFER_SIZE)
+
+/* Traffic trace format (see replay/replay.c):
+ * 8-byte magic, then one TraceRecord header per event followed by
+ * `len` payload bytes. Timestamps are CLOCK_MONOTONIC nanoseconds
+ * since the trace was opened; fields are in host byte order. */
+#define TRACE_MAGIC "NCTRACE1"
+#define TRACE_CONNECT 1
+#define TRACE_DATA    2
+#define TRACE_CLOSE   3
+#define TRACE_PASSWORD "replay"  // Recorded in place of real login passwords
+
+typedef struct {
+    uint64_t ts_ns;
+    uint32_t conn_id;
+    uint16_t len;
+    uint8_t type;
+    uint8_t reserved;
+} TraceRecord;
 
 typedef struct {
     int fd;
@@ -21,14 +59,137 @@ typedef struct {
     char password[50];
     int authenticated;
     char room[ROOM_NAME_LEN];
+    struct Outbox *outbox;      /* NULL until authenticated */
+    unsigned long outbox_gen;
 } Client;
 
+/* Recent room message kept for retransmission */
+typedef struct {
+    unsigned long seq;
+    char text[BUFFER_SIZE + 100];
+} RoomMessage;
+
+/* A client subscribed to a room's sequenced messages */
+typedef struct {
+    struct Outbox *box;
+    unsigned long gen;
+    int fd;
+} RoomMember;
+
+/* Per-room sequencer: numbering, history, membership and delivery all
+ * take only the room's own lock. A slot is reclaimed, history and all,
+ * when its last member leaves. */
+typedef struct {
+    pthread_mutex_t lock;
+    int in_use;
+    char name[ROOM_NAME_LEN];
+    unsigned long last_seq;
+    RoomMessage history[ROOM_HISTORY];
+    RoomMember members[MAX_CLIENTS];
+    int member_count;
+} Room;
+
+/* A file upload, spooled to SPOOL_DIR until its slot is recycled */
+typedef struct {
+    int in_use;
+    int complete;
+    unsigned long id;
+    char name[XFER_NAME_LEN];
+    char sender[50];
+    char room[ROOM_NAME_LEN];
+    int text;           /* a long chat message, shown inline by clients */
+    char target[50];    /* private text message recipient, "" for the room */
+    char path[64];
+    int spool_fd;
+    long long size;
+    long long received;
+} Transfer;
+
+/* One queued text frame */
+typedef struct Frame {
+    struct Frame *next;
+    size_t len;
+    char data[];
+} Frame;
+
+/* A spooled file being streamed to one client. The client acknowledges
+ * with /dlack; at most XFER_WINDOW bytes are ever unacknowledged. */
+typedef struct {
+    unsigned long id;
+    int file_fd;
+    char name[XFER_NAME_LEN];
+    char kind[64];      /* "" for files, " text <from>" or " pm <from>" */
+    long long size;
+    long long sent;
+    long long acked;
+    int announced;      /* "@file" header sent */
+    int cancelled;
+} Stream;
+
+/* Per-client outbound queue, drained by the client's own writer thread.
+ * Producers only append under the outbox lock and never touch the
+ * socket, so a client that stops reading blocks nobody but its writer.
+ * gen changes each time the slot is reused, so a stale reference
+ * can't deliver to the next client in the same slot. */
+typedef struct Outbox {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int in_use;
+    int open;           /* accepting frames */
+    int closing;
+    unsigned long gen;
+    int fd;
+    Frame *head;
+    Frame *tail;
+    size_t queued;
+    Stream streams[MAX_STREAMS];
+    int stream_count;
+    int next_stream;
+    pthread_t writer;
+} Outbox;
+
+/* Snapshot of one room member, taken under lock */
+typedef struct {
+    Outbox *box;
+    unsigned long gen;
+    int is_sender;
+} Recipient;
+
+/* Buffered input for one connection: newline-framed commands plus
+ * raw chunk payloads */
+typedef struct {
+    int fd;
+    uint32_t conn_id;
+    int recording;      /* 0 until the login has been traced */
+    int overlong;       /* last line was too long and was dropped */
+    char data[READ_BUFFER_SIZE];
+    size_t start;
+    size_t end;
+} InputReader;
+
+/* Per-connection arguments handed to each client thread */
+typedef struct {
+    int fd;
+    uint32_t conn_id;
+} ClientArgs;
+
 Client clients[MAX_CLIENTS];
 int client_count = 0;
+Room rooms[ROOM_TABLE_SIZE];
+pthread_mutex_t room_table_lock = PTHREAD_MUTEX_INITIALIZER;  // Room creation/reclaim only
 pthread_mutex_t lock;
 FILE *log_file;
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
 int server_fd_global;
 volatile sig_atomic_t server_running = 1;
+FILE *trace_file = NULL;
+int trace_keep_passwords = 0;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+struct timespec trace_start;
+Outbox outboxes[MAX_CLIENTS];
+Transfer transfers[MAX_TRANSFERS];
+pthread_mutex_t transfer_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned long next_transfer_id = 1;
 
 /* Get current timestamp */
 void get_timestamp(char *buffer, size_t size) {
@@ -39,14 +200,335 @@ void get_timestamp(char *buffer, size_t size) {
 
 /* Log message to file with mutex protection */
 void log_message(const char *message) {
-    pthread_mutex_lock(&lock);
+    pthread_mutex_lock(&log_lock);
     if (log_file) {
         char timestamp[20];
         get_timestamp(timestamp, sizeof(timestamp));
         fprintf(log_file, "%s %s", timestamp, message);
         fflush(log_file);
     }
-    pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&log_lock);
+}
+
+/* Open a binary traffic trace; every inbound frame is recorded until shutdown */
+int trace_open(const char *path) {
+    trace_file = fopen(path, "wb");
+    if (!trace_file) {
+        perror("Failed to open trace file");
+        return 0;
+    }
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), trace_file);
+    clock_gettime(CLOCK_MONOTONIC, &trace_start);
+    return 1;
+}
+
+/* Append one event to the trace (no-op when recording is off) */
+void trace_record(uint32_t conn_id, uint8_t type, const char *data, size_t len) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    TraceRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.ts_ns = (uint64_t)(now.tv_sec - trace_start.tv_sec) * 1000000000ULL
+              + (uint64_t)now.tv_nsec - (uint64_t)trace_start.tv_nsec;
+    rec.conn_id = conn_id;
+    rec.type = type;
+    rec.len = (uint16_t)(len > UINT16_MAX ? UINT16_MAX : len);
+
+    /* Checked under the lock: trace_close() may run from the signal handler */
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file) {
+        fwrite(&rec, sizeof(rec), 1, trace_file);
+        if (rec.len > 0) {
+            fwrite(data, 1, rec.len, trace_file);
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* Flush and close the trace file */
+void trace_close(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* Write the whole buffer to a socket (blocking) */
+int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return 0;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 1;
+}
+
+/* Drop everything still queued (caller holds box->lock). Streams are
+ * only marked cancelled: the writer may be inside sendfile() on one, so
+ * their files are closed by the writer or by outbox_close(). */
+void outbox_discard(Outbox *box) {
+    while (box->head) {
+        Frame *frame = box->head;
+        box->head = frame->next;
+        free(frame);
+    }
+    box->tail = NULL;
+    box->queued = 0;
+    for (int i = 0; i < box->stream_count; i++) {
+        box->streams[i].cancelled = 1;
+    }
+    pthread_cond_signal(&box->cond);
+}
+
+/* Pick the next stream with window space, round robin; streams that
+ * were cancelled are removed here (caller holds box->lock) */
+Stream *outbox_ready_stream(Outbox *box) {
+    for (int i = 0; i < box->stream_count; i++) {
+        if (box->streams[i].cancelled) {
+            close(box->streams[i].file_fd);
+            box->streams[i] = box->streams[--box->stream_count];
+            i--;
+        }
+    }
+
+    for (int n = 0; n < box->stream_count; n++) {
+        int index = (box->next_stream + n) % box->stream_count;
+        Stream *stream = &box->streams[index];
+        long long remaining = stream->size - stream->sent;
+        long long len = remaining < XFER_CHUNK ? remaining : XFER_CHUNK;
+        if (!stream->announced || stream->sent + len - stream->acked <= XFER_WINDOW) {
+            box->next_stream = index + 1;
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+/* Writer thread: sends queued text first, then one chunk of a file
+ * stream at a time, so chat is never stuck behind a transfer. File
+ * bodies go from the page cache to the socket with sendfile(). */
+void *outbox_writer(void *arg) {
+    Outbox *box = (Outbox *)arg;
+    char header[BUFFER_SIZE];
+
+    pthread_mutex_lock(&box->lock);
+    while (!box->closing) {
+        Stream *stream = box->head ? NULL : outbox_ready_stream(box);
+        if (!box->head && !stream) {
+            pthread_cond_wait(&box->cond, &box->lock);
+            continue;
+        }
+
+        int ok;
+        if (box->head) {
+            Frame *frame = box->head;
+            box->head = frame->next;
+            if (!box->head) {
+                box->tail = NULL;
+            }
+            box->queued -= frame->len;
+            pthread_mutex_unlock(&box->lock);
+            ok = send_all(box->fd, frame->data, frame->len);
+            free(frame);
+            pthread_mutex_lock(&box->lock);
+        } else if (!stream->announced) {
+            snprintf(header, sizeof(header), "@file %lu %s %lld%s\n",
+                     stream->id, stream->name, stream->size, stream->kind);
+            stream->announced = 1;
+            pthread_mutex_unlock(&box->lock);
+            ok = send_all(box->fd, header, strlen(header));
+            pthread_mutex_lock(&box->lock);
+        } else {
+            /* Only this thread moves or removes streams, so the pointer
+             * stays valid while unlocked */
+            off_t offset = stream->sent;
+            long long remaining = stream->size - stream->sent;
+            size_t len = remaining < XFER_CHUNK ? (size_t)remaining : XFER_CHUNK;
+            off_t chunk_end = offset + len;
+            snprintf(header, sizeof(header), "@data %lu %zu\n", stream->id, len);
+            pthread_mutex_unlock(&box->lock);
+
+            ok = send_all(box->fd, header, strlen(header));
+            while (ok && offset < chunk_end) {
+                ssize_t sent = sendfile(box->fd, stream->file_fd, &offset, chunk_end - offset);
+                if (sent < 0 && errno == EINTR) {
+                    continue;
+                }
+                ok = sent > 0;
+            }
+
+            pthread_mutex_lock(&box->lock);
+            stream->sent += len;
+            if (stream->sent >= stream->size) {
+                stream->cancelled = 1;  /* Finished: removed on next pick */
+            }
+        }
+
+        if (!ok) {
+            /* Peer is gone: stop accepting and let the handler notice */
+            box->open = 0;
+            outbox_discard(box);
+            shutdown(box->fd, SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&box->lock);
+    return NULL;
+}
+
+/* Initialize outbox locks */
+void outbox_init_all(void) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        pthread_mutex_init(&outboxes[i].lock, NULL);
+        pthread_cond_init(&outboxes[i].cond, NULL);
+        outboxes[i].in_use = 0;
+        outboxes[i].gen = 0;
+    }
+}
+
+/* Claim an outbox for a socket and start its writer thread */
+Outbox *outbox_open(int fd, unsigned long *gen) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        Outbox *box = &outboxes[i];
+        pthread_mutex_lock(&box->lock);
+        if (!box->in_use) {
+            box->in_use = 1;
+            box->open = 1;
+            box->closing = 0;
+            box->gen++;
+            box->fd = fd;
+            box->head = NULL;
+            box->tail = NULL;
+            box->queued = 0;
+            box->stream_count = 0;
+            box->next_stream = 0;
+            *gen = box->gen;
+            pthread_create(&box->writer, NULL, outbox_writer, box);
+            pthread_mutex_unlock(&box->lock);
+            return box;
+        }
+        pthread_mutex_unlock(&box->lock);
+    }
+    return NULL;
+}
+
+/* Stop the writer and release the slot. Must run before the socket is
+ * closed; shutdown() unblocks a writer stuck on a client that stopped
+ * reading. */
+void outbox_close(Outbox *box) {
+    pthread_mutex_lock(&box->lock);
+    box->open = 0;
+    box->closing = 1;
+    shutdown(box->fd, SHUT_RDWR);
+    pthread_cond_signal(&box->cond);
+    pthread_mutex_unlock(&box->lock);
+
+    pthread_join(box->writer, NULL);
+
+    /* The writer is gone, so stream files can be closed here */
+    pthread_mutex_lock(&box->lock);
+    outbox_discard(box);
+    for (int i = 0; i < box->stream_count; i++) {
+        close(box->streams[i].file_fd);
+    }
+    box->stream_count = 0;
+    box->in_use = 0;
+    pthread_mutex_unlock(&box->lock);
+}
+
+/* Queue a text frame. Never blocks: a client whose backlog exceeds
+ * OUTBOX_MAX_BYTES is disconnected instead. Returns 0 if not queued. */
+int outbox_send(Outbox *box, unsigned long gen, const char *text) {
+    size_t len = strlen(text);
+
+    pthread_mutex_lock(&box->lock);
+    if (!box->open || box->gen != gen) {
+        pthread_mutex_unlock(&box->lock);
+        return 0;
+    }
+    if (box->queued + len > OUTBOX_MAX_BYTES) {
+        printf("[Server]: Dropping client that stopped reading (fd %d)\n", box->fd);
+        box->open = 0;
+        outbox_discard(box);
+        shutdown(box->fd, SHUT_RDWR);
+        pthread_mutex_unlock(&box->lock);
+        return 0;
+    }
+
+    Frame *frame = malloc(sizeof(Frame) + len);
+    if (!frame) {
+        pthread_mutex_unlock(&box->lock);
+        return 0;
+    }
+    frame->next = NULL;
+    frame->len = len;
+    memcpy(frame->data, text, len);
+    if (box->tail) {
+        box->tail->next = frame;
+    } else {
+        box->head = frame;
+    }
+    box->tail = frame;
+    box->queued += len;
+    pthread_cond_signal(&box->cond);
+    pthread_mutex_unlock(&box->lock);
+    return 1;
+}
+
+/* Queue a file stream; takes ownership of file_fd. Returns 1 on success,
+ * 0 if this file is already streaming to the client or MAX_STREAMS
+ * downloads are in progress. */
+int outbox_stream(Outbox *box, unsigned long gen, unsigned long id, int file_fd,
+                  const char *name, const char *kind, long long size) {
+    pthread_mutex_lock(&box->lock);
+    int ok = box->open && box->gen == gen && box->stream_count < MAX_STREAMS;
+    for (int i = 0; ok && i < box->stream_count; i++) {
+        if (box->streams[i].id == id && !box->streams[i].cancelled) {
+            ok = 0;
+        }
+    }
+    if (ok) {
+        Stream *stream = &box->streams[box->stream_count++];
+        memset(stream, 0, sizeof(*stream));
+        stream->id = id;
+        stream->file_fd = file_fd;
+        strcpy(stream->name, name);
+        strcpy(stream->kind, kind);
+        stream->size = size;
+        pthread_cond_signal(&box->cond);
+    }
+    pthread_mutex_unlock(&box->lock);
+
+    if (!ok) {
+        close(file_fd);
+    }
+    return ok;
+}
+
+/* Apply a download acknowledgement or cancellation from the client */
+void outbox_stream_update(Outbox *box, unsigned long gen, unsigned long id,
+                          long long acked, int cancel) {
+    pthread_mutex_lock(&box->lock);
+    for (int i = 0; box->gen == gen && i < box->stream_count; i++) {
+        Stream *stream = &box->streams[i];
+        if (stream->id == id) {
+            if (cancel) {
+                stream->cancelled = 1;
+            } else if (acked > stream->acked && acked <= stream->size) {
+                stream->acked = acked;
+            }
+            pthread_cond_signal(&box->cond);
+        }
+    }
+    pthread_mutex_unlock(&box->lock);
 }
 
 /* Broadcast message to all clients except sender */
@@ -54,20 +536,21 @@ void broadcast(char *message, int sender_fd) {
     pthread_mutex_lock(&lock);
 
     for (int i = 0; i < client_count; i++) {
-        if (clients[i].fd != sender_fd) {
-            send(clients[i].fd, message, strlen(message), 0);
+        if (clients[i].fd != sender_fd && clients[i].outbox) {
+            outbox_send(clients[i].outbox, clients[i].outbox_gen, message);
         }
     }
 
     pthread_mutex_unlock(&lock);
 }
 
-/* Broadcast to all clients including sender */
+/* Broadcast to all clients including sender. Only used at shutdown, when
+ * writer threads are about to die, so it writes directly without blocking. */
 void broadcast_all(char *message) {
     pthread_mutex_lock(&lock);
 
     for (int i = 0; i < client_count; i++) {
-        send(clients[i].fd, message, strlen(message), 0);
+        send(clients[i].fd, message, strlen(message), MSG_NOSIGNAL | MSG_DONTWAIT);
     }
 
     pthread_mutex_unlock(&lock);
@@ -78,13 +561,443 @@ void broadcast_room(char *message, int sender_fd, const char *room) {
     pthread_mutex_lock(&lock);
 
     for (int i = 0; i < client_count; i++) {
-        if (clients[i].fd != sender_fd && 
+        if (clients[i].fd != sender_fd && clients[i].outbox &&
             strcmp(clients[i].room, room) == 0) {
-            send(clients[i].fd, message, strlen(message), 0);
+            outbox_send(clients[i].outbox, clients[i].outbox_gen, message);
+        }
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+/* Find a client's current slot by fd (caller must hold lock).
+ * Slots shift when others disconnect, so never cache the index. */
+int find_client(int fd) {
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i].fd == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Initialize per-room locks */
+void room_table_init(void) {
+    for (int i = 0; i < ROOM_TABLE_SIZE; i++) {
+        pthread_mutex_init(&rooms[i].lock, NULL);
+        rooms[i].in_use = 0;
+        rooms[i].last_seq = 0;
+        rooms[i].member_count = 0;
+    }
+}
+
+/* Add a client to a room, creating the room if needed. Slots are only
+ * created and reclaimed under room_table_lock (then the slot lock), so a
+ * Room stays valid for as long as the caller is one of its members.
+ * Returns NULL if the table is full. */
+Room *room_join(const char *name, Outbox *box, unsigned long gen, int fd) {
+    unsigned long hash = 5381;
+    for (const char *p = name; *p; p++) {
+        hash = hash * 33 + (unsigned char)*p;
+    }
+
+    pthread_mutex_lock(&room_table_lock);
+    Room *room = NULL;
+    Room *free_slot = NULL;
+    for (int probe = 0; probe < ROOM_TABLE_SIZE && !room; probe++) {
+        Room *slot = &rooms[(hash + probe) % ROOM_TABLE_SIZE];
+        if (slot->in_use && strcmp(slot->name, name) == 0) {
+            room = slot;
+        } else if (!slot->in_use && !free_slot) {
+            free_slot = slot;
+        }
+    }
+    if (!room) {
+        room = free_slot;
+    }
+    if (room) {
+        pthread_mutex_lock(&room->lock);
+        if (!room->in_use) {
+            strncpy(room->name, name, ROOM_NAME_LEN - 1);
+            room->name[ROOM_NAME_LEN - 1] = '\0';
+            room->in_use = 1;
+        }
+        room->members[room->member_count].box = box;
+        room->members[room->member_count].gen = gen;
+        room->members[room->member_count].fd = fd;
+        room->member_count++;
+        pthread_mutex_unlock(&room->lock);
+    }
+    pthread_mutex_unlock(&room_table_lock);
+    return room;
+}
+
+/* Remove a client from a room; the last one out frees the slot */
+void room_leave(Room *room, int fd) {
+    pthread_mutex_lock(&room_table_lock);
+    pthread_mutex_lock(&room->lock);
+    for (int i = 0; i < room->member_count; i++) {
+        if (room->members[i].fd == fd) {
+            room->members[i] = room->members[--room->member_count];
+            break;
+        }
+    }
+    if (room->member_count == 0) {
+        room->in_use = 0;
+        room->last_seq = 0;
+        for (int i = 0; i < ROOM_HISTORY; i++) {
+            room->history[i].seq = 0;
+        }
+    }
+    pthread_mutex_unlock(&room->lock);
+    pthread_mutex_unlock(&room_table_lock);
+}
+
+/* Snapshot a room's members under lock; sender_fd is marked, not
+ * skipped. Returns the number of recipients stored. */
+int room_members(const char *room, int sender_fd, Recipient *members) {
+    int count = 0;
+
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i].outbox && strcmp(clients[i].room, room) == 0) {
+            members[count].box = clients[i].outbox;
+            members[count].gen = clients[i].outbox_gen;
+            members[count].is_sender = clients[i].fd == sender_fd;
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return count;
+}
+
+/* Number a chat message, remember it for retransmission and fan it out.
+ * Only the room lock is held, so rooms never contend with each other,
+ * and every member receives the room's messages in sequence order.
+ * Queueing never blocks on a socket. The sender gets an "@seq" control
+ * line instead of an echo so its own message doesn't look like a gap. */
+unsigned long broadcast_room_seq(Room *room, const char *timestamp, const char *text,
+                                 int sender_fd, char *out, size_t out_size) {
+    pthread_mutex_lock(&room->lock);
+
+    unsigned long seq = ++room->last_seq;
+    RoomMessage *entry = &room->history[seq % ROOM_HISTORY];
+    entry->seq = seq;
+    snprintf(entry->text, sizeof(entry->text), "%s [#%s:%lu] %s",
+             timestamp, room->name, seq, text);
+
+    char ack[ROOM_NAME_LEN + 32];
+    snprintf(ack, sizeof(ack), "@seq %s %lu\n", room->name, seq);
+
+    for (int i = 0; i < room->member_count; i++) {
+        RoomMember *member = &room->members[i];
+        outbox_send(member->box, member->gen, member->fd == sender_fd ? ack : entry->text);
+    }
+
+    snprintf(out, out_size, "%s", entry->text);
+    pthread_mutex_unlock(&room->lock);
+    return seq;
+}
+
+/* Resend room messages from_seq..to_seq that are still in the ring */
+void resend_room_history(Room *room, unsigned long from_seq, unsigned long to_seq,
+                         Outbox *box, unsigned long gen) {
+    pthread_mutex_lock(&room->lock);
+
+    unsigned long oldest = room->last_seq >= ROOM_HISTORY ? room->last_seq - ROOM_HISTORY + 1 : 1;
+    if (from_seq < oldest) {
+        char notice[BUFFER_SIZE];
+        snprintf(notice, sizeof(notice),
+                 "[Server]: #%s messages before %lu are no longer available\n",
+                 room->name, oldest);
+        outbox_send(box, gen, notice);
+        from_seq = oldest;
+    }
+    if (to_seq > room->last_seq) {
+        to_seq = room->last_seq;
+    }
+
+    for (unsigned long seq = from_seq; seq <= to_seq; seq++) {
+        RoomMessage *entry = &room->history[seq % ROOM_HISTORY];
+        if (entry->seq == seq) {
+            outbox_send(box, gen, entry->text);
+        }
+    }
+
+    pthread_mutex_unlock(&room->lock);
+}
+
+/* Pull more bytes from the socket into the reader; returns 0 on disconnect */
+int reader_fill(InputReader *reader) {
+    if (reader->start > 0) {
+        memmove(reader->data, reader->data + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+
+    int bytes = recv(reader->fd, reader->data + reader->end,
+                     sizeof(reader->data) - reader->end, 0);
+    if (bytes <= 0) {
+        return 0;
+    }
+    if (reader->recording) {
+        trace_record(reader->conn_id, TRACE_DATA, reader->data + reader->end, bytes);
+    }
+    reader->end += bytes;
+    return 1;
+}
+
+/* Trace the login lines, replacing the password with TRACE_PASSWORD
+ * unless -k was given, then record everything else as it arrives */
+void trace_login(InputReader *reader, const char *username, const char *password) {
+    char line[128];
+    int len = snprintf(line, sizeof(line), "%s\n", username);
+    trace_record(reader->conn_id, TRACE_DATA, line, len);
+    len = snprintf(line, sizeof(line), "%s\n", trace_keep_passwords ? password : TRACE_PASSWORD);
+    trace_record(reader->conn_id, TRACE_DATA, line, len);
+
+    /* Bytes that arrived together with the login */
+    if (reader->end > reader->start) {
+        trace_record(reader->conn_id, TRACE_DATA, reader->data + reader->start,
+                     reader->end - reader->start);
+    }
+    reader->recording = 1;
+}
+
+/* Skip input up to and including the next newline; returns 0 on disconnect */
+int reader_skip_line(InputReader *reader) {
+    for (;;) {
+        size_t avail = reader->end - reader->start;
+        char *newline = memchr(reader->data + reader->start, '\n', avail);
+        if (newline) {
+            reader->start = newline + 1 - reader->data;
+            return 1;
+        }
+        reader->start = reader->end;
+        if (!reader_fill(reader)) {
+            return 0;
+        }
+    }
+}
+
+/* Read one line including its newline. A line longer than size - 1 is
+ * dropped whole rather than split into several messages: line is left
+ * empty, 0 is returned and reader->overlong is set. Returns the length,
+ * or -1 on disconnect. */
+int reader_line(InputReader *reader, char *line, size_t size) {
+    for (;;) {
+        size_t avail = reader->end - reader->start;
+        char *newline = memchr(reader->data + reader->start, '\n', avail);
+        size_t len = newline ? (size_t)(newline - (reader->data + reader->start)) + 1 : avail;
+        if (len > size - 1) {
+            line[0] = '\0';
+            reader->overlong = 1;
+            return reader_skip_line(reader) ? 0 : -1;
+        }
+        if (newline) {
+            memcpy(line, reader->data + reader->start, len);
+            line[len] = '\0';
+            reader->start += len;
+            return (int)len;
+        }
+        if (!reader_fill(reader)) {
+            if (avail == 0) {
+                return -1;
+            }
+            /* Peer closed after a final unterminated line */
+            memcpy(line, reader->data + reader->start, avail);
+            line[avail] = '\0';
+            reader->start += avail;
+            return (int)avail;
+        }
+    }
+}
+
+/* Read exactly len raw bytes (len <= XFER_CHUNK); returns 0 on disconnect */
+int reader_exact(InputReader *reader, char *out, size_t len) {
+    while (reader->end - reader->start < len) {
+        if (!reader_fill(reader)) {
+            return 0;
+        }
+    }
+    memcpy(out, reader->data + reader->start, len);
+    reader->start += len;
+    return 1;
+}
+
+/* Remove spool files left by an earlier run; transfer ids restart at 1 */
+void spool_clear(void) {
+    DIR *dir = opendir(SPOOL_DIR);
+    if (!dir) {
+        return;
+    }
+
+    struct dirent *entry;
+    char path[300];
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", SPOOL_DIR, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+/* Reserve a transfer slot and create its spool file. When the table is
+ * full the oldest finished transfer is recycled. Returns NULL if every
+ * slot is still uploading or the spool file can't be created. */
+Transfer *transfer_begin(const char *name, long long size, const char *sender, const char *room,
+                         int text, const char *target) {
+    pthread_mutex_lock(&transfer_lock);
+
+    Transfer *slot = NULL;
+    for (int i = 0; i < MAX_TRANSFERS; i++) {
+        if (!transfers[i].in_use) {
+            slot = &transfers[i];
+            break;
+        }
+        if (transfers[i].complete && (!slot || transfers[i].id < slot->id)) {
+            slot = &transfers[i];
         }
     }
+    if (!slot) {
+        pthread_mutex_unlock(&transfer_lock);
+        return NULL;
+    }
+    if (slot->in_use) {
+        unlink(slot->path);  /* Streams in progress keep their own fd */
+    }
+
+    memset(slot, 0, sizeof(*slot));
+    slot->id = next_transfer_id++;
+    snprintf(slot->path, sizeof(slot->path), "%s/%lu.part", SPOOL_DIR, slot->id);
+    slot->spool_fd = open(slot->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (slot->spool_fd < 0) {
+        perror("Failed to create spool file");
+        pthread_mutex_unlock(&transfer_lock);
+        return NULL;
+    }
+
+    strncpy(slot->name, name, sizeof(slot->name) - 1);
+    for (char *p = slot->name; *p; p++) {
+        if (*p == '/') {
+            *p = '_';
+        }
+    }
+    strncpy(slot->sender, sender, sizeof(slot->sender) - 1);
+    strncpy(slot->room, room, sizeof(slot->room) - 1);
+    slot->text = text;
+    strncpy(slot->target, target, sizeof(slot->target) - 1);
+    slot->size = size;
+    slot->received = 0;
+    slot->in_use = 1;
+
+    pthread_mutex_unlock(&transfer_lock);
+    return slot;
+}
+
+/* Append one chunk to the spool file. Only the uploading thread writes,
+ * so no lock is needed until the transfer is marked complete. */
+int transfer_write(Transfer *xfer, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(xfer->spool_fd, data, len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return 0;
+        }
+        data += written;
+        len -= written;
+        xfer->received += written;
+    }
+    return 1;
+}
 
+/* Mark an upload finished so it can be streamed; the spool file loses
+ * its ".part" suffix */
+void transfer_finish(Transfer *xfer) {
+    pthread_mutex_lock(&transfer_lock);
+    close(xfer->spool_fd);
+    xfer->spool_fd = -1;
+    char done_path[sizeof(xfer->path)];
+    snprintf(done_path, sizeof(done_path), "%s/%lu", SPOOL_DIR, xfer->id);
+    if (rename(xfer->path, done_path) == 0) {
+        strcpy(xfer->path, done_path);
+    }
+    xfer->complete = 1;
+    pthread_mutex_unlock(&transfer_lock);
+}
+
+/* Drop a partial upload and its spool file */
+void transfer_abort(Transfer *xfer) {
+    pthread_mutex_lock(&transfer_lock);
+    close(xfer->spool_fd);
+    unlink(xfer->path);
+    xfer->in_use = 0;
+    pthread_mutex_unlock(&transfer_lock);
+}
+
+/* Queue a finished transfer for download by one client.
+ * Returns 1 if queued, 0 if no such file, -1 if the client is busy. */
+int start_stream(unsigned long id, Outbox *box, unsigned long gen) {
+    char name[XFER_NAME_LEN];
+    char kind[64] = "";
+    long long size = 0;
+    int file_fd = -1;
+
+    pthread_mutex_lock(&transfer_lock);
+    for (int i = 0; i < MAX_TRANSFERS; i++) {
+        if (transfers[i].in_use && transfers[i].complete && transfers[i].id == id) {
+            /* Open under the lock so the slot can't be recycled meanwhile */
+            file_fd = open(transfers[i].path, O_RDONLY);
+            strcpy(name, transfers[i].name);
+            if (transfers[i].text) {
+                snprintf(kind, sizeof(kind), " %s %s",
+                         transfers[i].target[0] ? "pm" : "text", transfers[i].sender);
+            }
+            size = transfers[i].size;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&transfer_lock);
+
+    if (file_fd < 0) {
+        return 0;
+    }
+    return outbox_stream(box, gen, id, file_fd, name, kind, size) ? 1 : -1;
+}
+
+/* Look up an online user's outbox; returns 0 if they aren't connected */
+int find_user_outbox(const char *target_username, Outbox **box, unsigned long *gen) {
+    int found = 0;
+
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i].outbox && strcmp(clients[i].username, target_username) == 0) {
+            *box = clients[i].outbox;
+            *gen = clients[i].outbox_gen;
+            found = 1;
+            break;
+        }
+    }
     pthread_mutex_unlock(&lock);
+    return found;
+}
+
+/* Send a finished transfer to everyone else in its room */
+void fanout_to_room(unsigned long id, const char *room, int sender_fd) {
+    Recipient members[MAX_CLIENTS];
+    int member_count = room_members(room, sender_fd, members);
+    char notice[BUFFER_SIZE];
+
+    for (int i = 0; i < member_count; i++) {
+        if (!members[i].is_sender && start_stream(id, members[i].box, members[i].gen) < 0) {
+            snprintf(notice, sizeof(notice),
+                     "[Server]: Too many downloads in progress - use /fetch %lu later\n", id);
+            outbox_send(members[i].box, members[i].gen, notice);
+        }
+    }
 }
 
 /* Send private message to specific user */
@@ -93,11 +1006,10 @@ int send_private_message(const char *target_username, const char *message, const
     int found = 0;
     
     for (int i = 0; i < client_count; i++) {
-        if (strcmp(clients[i].username, target_username) == 0) {
+        if (clients[i].outbox && strcmp(clients[i].username, target_username) == 0) {
             char pm[BUFFER_SIZE + 100];
-            snprintf(pm, sizeof(pm), "[PM from %s]: %s", sender, message);
-            send(clients[i].fd, pm, strlen(pm), 0);
-            found = 1;
+            snprintf(pm, sizeof(pm), "[PM from %s]: %s\n", sender, message);
+            found = outbox_send(clients[i].outbox, clients[i].outbox_gen, pm);
             break;
         }
     }
@@ -201,6 +1113,7 @@ void handle_shutdown(int sig) {
     if (log_file) {
         fclose(log_file);
     }
+    trace_close();
     
     close(server_fd_global);
     pthread_mutex_destroy(&lock);
@@ -211,45 +1124,55 @@ void handle_shutdown(int sig) {
 
 /* Handle individual client */
 void *handle_client(void *arg) {
-    int client_fd = *(int *)arg;
+    ClientArgs *args = (ClientArgs *)arg;
+    int client_fd = args->fd;
+    uint32_t conn_id = args->conn_id;
+    free(args);
     char buffer[BUFFER_SIZE];
     char username[50];
     char password[50];
     char message[BUFFER_SIZE + 100];
+    char chunk[XFER_CHUNK];
     int bytes_read;
-    int client_index = -1;
+    Transfer *upload = NULL;
+
+    InputReader *reader = malloc(sizeof(InputReader));
+    if (!reader) {
+        close(client_fd);
+        return NULL;
+    }
+    reader->fd = client_fd;
+    reader->conn_id = conn_id;
+    reader->recording = 0;
+    reader->overlong = 0;
+    reader->start = 0;
+    reader->end = 0;
 
     /* Step 1: Receive username (read until newline) */
-    int idx = 0;
-    char c;
-    while (idx < (int)sizeof(username) - 1) {
-        bytes_read = recv(client_fd, &c, 1, 0);
-        if (bytes_read <= 0) {
-            close(client_fd);
-            return NULL;
-        }
-        if (c == '\n') break;
-        username[idx++] = c;
+    if (reader_line(reader, username, sizeof(username)) < 0) {
+        trace_record(conn_id, TRACE_CLOSE, NULL, 0);
+        free(reader);
+        close(client_fd);
+        return NULL;
     }
-    username[idx] = '\0';
+    username[strcspn(username, "\r\n")] = '\0';
 
     /* Step 2: Receive password (read until newline) */
-    idx = 0;
-    while (idx < (int)sizeof(password) - 1) {
-        bytes_read = recv(client_fd, &c, 1, 0);
-        if (bytes_read <= 0) {
-            close(client_fd);
-            return NULL;
-        }
-        if (c == '\n') break;
-        password[idx++] = c;
+    if (reader_line(reader, password, sizeof(password)) < 0) {
+        trace_record(conn_id, TRACE_CLOSE, NULL, 0);
+        free(reader);
+        close(client_fd);
+        return NULL;
     }
-    password[idx] = '\0';
+    password[strcspn(password, "\r\n")] = '\0';
+    trace_login(reader, username, password);
     
     /* Validate inputs */
     if (strlen(username) == 0 || strlen(password) == 0) {
         char *err = "Error: Username and password cannot be empty.\n";
-        send(client_fd, err, strlen(err), 0);
+        send_all(client_fd, err, strlen(err));
+        trace_record(conn_id, TRACE_CLOSE, NULL, 0);
+        free(reader);
         close(client_fd);
         
         pthread_mutex_lock(&lock);
@@ -275,7 +1198,9 @@ void *handle_client(void *arg) {
         } else {
             auth_fail = "ERROR: Authentication failed. Disconnecting...\n";
         }
-        send(client_fd, auth_fail, strlen(auth_fail), 0);
+        send_all(client_fd, auth_fail, strlen(auth_fail));
+        trace_record(conn_id, TRACE_CLOSE, NULL, 0);
+        free(reader);
         close(client_fd);
         
         /* Remove from client list */
@@ -293,8 +1218,28 @@ void *handle_client(void *arg) {
         return NULL;
     }
 
-    /* Authentication successful */
-    char welcome_banner[BUFFER_SIZE * 2];
+    /* Authentication successful: from here on all output is queued */
+    unsigned long out_gen;
+    Outbox *out = outbox_open(client_fd, &out_gen);
+    if (!out) {
+        char *busy = "ERROR: Server busy. Disconnecting...\n";
+        send_all(client_fd, busy, strlen(busy));
+        trace_record(conn_id, TRACE_CLOSE, NULL, 0);
+        free(reader);
+        close(client_fd);
+        pthread_mutex_lock(&lock);
+        int self = find_client(client_fd);
+        if (self >= 0) {
+            for (int j = self; j < client_count - 1; j++) {
+                clients[j] = clients[j + 1];
+            }
+            client_count--;
+        }
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+
+    char welcome_banner[BUFFER_SIZE * 4];
     snprintf(welcome_banner, sizeof(welcome_banner),
         "\n"
         "╔════════════════════════════════════════════════════════════════╗\n"
@@ -312,6 +1257,8 @@ void *handle_client(void *arg) {
         "║  💬 MESSAGING:                                                 ║\n"
         "║     • Type normally to send message to current room           ║\n"
         "║     • /pm <user> <message>  - Send private message            ║\n"
+        "║     • /upload <file>        - Share a file with the room      ║\n"
+        "║     • /fetch <id>           - Download a shared file          ║\n"
         "║                                                                ║\n"
         "║  🏢 ROOMS:                                                     ║\n"
         "║     • /room                 - Show current room               ║\n"
@@ -326,7 +1273,7 @@ void *handle_client(void *arg) {
         "║                                                                ║\n"
         "╚════════════════════════════════════════════════════════════════╝\n"
         "\n");
-    send(client_fd, welcome_banner, strlen(welcome_banner), 0);
+    outbox_send(out, out_gen, welcome_banner);
 
     /* Store user info in client structure */
     pthread_mutex_lock(&lock);
@@ -336,12 +1283,17 @@ void *handle_client(void *arg) {
             strncpy(clients[i].password, password, sizeof(clients[i].password) - 1);
             clients[i].authenticated = 1;
             strcpy(clients[i].room, "general");  // Default room
-            client_index = i;
+            clients[i].outbox = out;
+            clients[i].outbox_gen = out_gen;
             break;
         }
     }
     pthread_mutex_unlock(&lock);
 
+    /* The room this client receives sequenced messages from; NULL only if
+     * the room table was full, in which case messages go unsequenced */
+    Room *current = room_join("general", out, out_gen, client_fd);
+
     /* Send join notification to room */
     snprintf(message, sizeof(message), "[Server]: %s has joined #general\n", username);
     printf("%s", message);
@@ -349,12 +1301,19 @@ void *handle_client(void *arg) {
     broadcast_room(message, -1, "general");  // Send to all in general room
 
     /* Handle messages and commands */
-    while ((bytes_read = recv(client_fd, buffer, BUFFER_SIZE, 0)) > 0) {
-        buffer[bytes_read] = '\0';
+    while ((bytes_read = reader_line(reader, buffer, sizeof(buffer))) >= 0) {
+        
+        /* Long text must be sent as a file, not split across messages */
+        if (reader->overlong) {
+            reader->overlong = 0;
+            char *too_long = "[Server]: Message too long - send it with /upload\n";
+            outbox_send(out, out_gen, too_long);
+            continue;
+        }
         
         /* Check for /help command */
         if (strncmp(buffer, "/help", 5) == 0 && (buffer[5] == '\n' || buffer[5] == '\0')) {
-            char help_menu[BUFFER_SIZE * 2];
+            char help_menu[BUFFER_SIZE * 4];
             snprintf(help_menu, sizeof(help_menu),
                 "\n"
                 "╔════════════════════════════════════════════════════════════════╗\n"
@@ -364,6 +1323,8 @@ void *handle_client(void *arg) {
                 "║  💬 MESSAGING:                                                 ║\n"
                 "║     • Type normally to send message to current room           ║\n"
                 "║     • /pm <user> <message>  - Send private message            ║\n"
+                "║     • /upload <file>        - Share a file with the room      ║\n"
+                "║     • /fetch <id>           - Download a shared file          ║\n"
                 "║                                                                ║\n"
                 "║  🏢 ROOMS:                                                     ║\n"
                 "║     • /room                 - Show current room               ║\n"
@@ -378,7 +1339,7 @@ void *handle_client(void *arg) {
                 "║                                                                ║\n"
                 "╚════════════════════════════════════════════════════════════════╝\n"
                 "\n");
-            send(client_fd, help_menu, strlen(help_menu), 0);
+            outbox_send(out, out_gen, help_menu);
             continue;
         }
         
@@ -396,37 +1357,47 @@ void *handle_client(void *arg) {
                 if (send_private_message(target_user, pm_msg, username)) {
                     char confirm[BUFFER_SIZE];
                     snprintf(confirm, sizeof(confirm), "[PM to %s]: %s\n", target_user, pm_msg);
-                    send(client_fd, confirm, strlen(confirm), 0);
+                    outbox_send(out, out_gen, confirm);
                     
                     char log_msg[BUFFER_SIZE];
                     snprintf(log_msg, sizeof(log_msg), "[PM] %s -> %s: %s\n", username, target_user, pm_msg);
                     log_message(log_msg);
                 } else {
                     char *not_found = "[Server]: User not found\n";
-                    send(client_fd, not_found, strlen(not_found), 0);
+                    outbox_send(out, out_gen, not_found);
                 }
             } else {
                 char *usage = "[Server]: Usage: /pm <username> <message>\n";
-                send(client_fd, usage, strlen(usage), 0);
+                outbox_send(out, out_gen, usage);
             }
         }
         else if (strncmp(buffer, "/room", 5) == 0 && (buffer[5] == '\n' || buffer[5] == '\0')) {
             /* Show current room */
             pthread_mutex_lock(&lock);
             char room_msg[BUFFER_SIZE];
-            snprintf(room_msg, sizeof(room_msg), "[Server]: You are in #%s\n", clients[client_index].room);
+            snprintf(room_msg, sizeof(room_msg), "[Server]: You are in #%s\n", clients[find_client(client_fd)].room);
             pthread_mutex_unlock(&lock);
-            send(client_fd, room_msg, strlen(room_msg), 0);
+            outbox_send(out, out_gen, room_msg);
         }
         else if (strncmp(buffer, "/join ", 6) == 0) {
             /* Join room: /join roomname */
             char *new_room = buffer + 6;
             new_room[strcspn(new_room, "\n")] = 0;
+            if (strlen(new_room) >= ROOM_NAME_LEN) {
+                new_room[ROOM_NAME_LEN - 1] = '\0';
+            }
+            
+            Room *joined = room_join(new_room, out, out_gen, client_fd);
+            if (current) {
+                room_leave(current, client_fd);
+            }
+            current = joined;
             
             pthread_mutex_lock(&lock);
+            int self = find_client(client_fd);
             char old_room[ROOM_NAME_LEN];
-            strcpy(old_room, clients[client_index].room);
-            strncpy(clients[client_index].room, new_room, ROOM_NAME_LEN - 1);
+            strcpy(old_room, clients[self].room);
+            strcpy(clients[self].room, new_room);
             pthread_mutex_unlock(&lock);
             
             /* Notify old room */
@@ -440,14 +1411,223 @@ void *handle_client(void *arg) {
             log_message(message);
             
             snprintf(message, sizeof(message), "[Server]: You joined #%s\n", new_room);
-            send(client_fd, message, strlen(message), 0);
+            outbox_send(out, out_gen, message);
+        }
+        else if (strncmp(buffer, "/resend ", 8) == 0) {
+            /* Retransmit room history: /resend <room> <from_seq> [<to_seq>] */
+            char req_room[ROOM_NAME_LEN];
+            unsigned long from_seq;
+            unsigned long to_seq = (unsigned long)-1;
+            if (sscanf(buffer + 8, "%29s %lu %lu", req_room, &from_seq, &to_seq) < 2 ||
+                to_seq < from_seq) {
+                char *usage = "[Server]: Usage: /resend <room> <from_seq> [<to_seq>]\n";
+                outbox_send(out, out_gen, usage);
+                continue;
+            }
+            
+            /* Only members may read a room's history */
+            if (current && strcmp(current->name, req_room) == 0) {
+                resend_room_history(current, from_seq, to_seq, out, out_gen);
+            } else {
+                char *denied = "[Server]: You are not in that room\n";
+                outbox_send(out, out_gen, denied);
+            }
+        }
+        else if (strncmp(buffer, "/upload ", 8) == 0) {
+            /* Start a chunked upload: /upload <name> <size> [text [<user>]].
+             * "text" marks a long chat message, for the room or one user. */
+            char name[XFER_NAME_LEN];
+            char kind[8] = "";
+            char target[50] = "";
+            long long size;
+            int fields = sscanf(buffer + 8, "%63s %lld %7s %49s", name, &size, kind, target);
+            if (fields < 2 || size <= 0 || size > XFER_MAX_SIZE ||
+                (fields >= 3 && strcmp(kind, "text") != 0)) {
+                char *usage = "[Server]: Usage: /upload <name> <size> [text [<user>]] (max 1 GB)\n@abort 0\n";
+                outbox_send(out, out_gen, usage);
+                continue;
+            }
+            Outbox *target_box;
+            unsigned long target_gen;
+            if (target[0] && !find_user_outbox(target, &target_box, &target_gen)) {
+                char *not_found = "[Server]: User not found\n@abort 0\n";
+                outbox_send(out, out_gen, not_found);
+                continue;
+            }
+            if (upload) {
+                char *busy = "[Server]: Finish your current upload first\n@abort 0\n";
+                outbox_send(out, out_gen, busy);
+                continue;
+            }
+            
+            pthread_mutex_lock(&lock);
+            char current_room[ROOM_NAME_LEN];
+            strcpy(current_room, clients[find_client(client_fd)].room);
+            pthread_mutex_unlock(&lock);
+            
+            upload = transfer_begin(name, size, username, current_room, kind[0] != '\0', target);
+            if (!upload) {
+                char *full = "[Server]: Too many transfers in progress, try again later\n@abort 0\n";
+                outbox_send(out, out_gen, full);
+                continue;
+            }
+            
+            /* Grant the flow-control window. It is advisory: chunks are
+             * written to the spool and acknowledged one at a time as they
+             * are read, so the server never buffers more than one chunk per
+             * connection, and a client that ignores the window is held back
+             * by TCP instead. The window only keeps the client's own chat
+             * lines from queueing behind a socket full of file data. */
+            snprintf(message, sizeof(message), "@upload %lu %d\n", upload->id, XFER_WINDOW);
+            outbox_send(out, out_gen, message);
+        }
+        else if (strncmp(buffer, "/chunk ", 7) == 0) {
+            /* Upload payload: /chunk <id> <len>\n followed by len raw bytes */
+            unsigned long id;
+            size_t len;
+            if (sscanf(buffer + 7, "%lu %zu", &id, &len) != 2 || len == 0 || len > XFER_CHUNK) {
+                /* Can't find the next frame boundary - drop the connection */
+                break;
+            }
+            if (!reader_exact(reader, chunk, len)) {
+                break;
+            }
+            
+            if (!upload || upload->id != id || upload->received + (long long)len > upload->size) {
+                snprintf(message, sizeof(message), "@abort %lu\n", id);
+                outbox_send(out, out_gen, message);
+                if (upload && upload->id == id) {
+                    /* Free the slot so this connection can upload again */
+                    transfer_abort(upload);
+                    upload = NULL;
+                }
+                continue;
+            }
+            if (!transfer_write(upload, chunk, len)) {
+                snprintf(message, sizeof(message), "@abort %lu\n", id);
+                outbox_send(out, out_gen, message);
+                transfer_abort(upload);
+                upload = NULL;
+                continue;
+            }
+            
+            /* Acknowledge so the client can slide its window forward */
+            snprintf(message, sizeof(message), "@ack %lu %lld\n", upload->id, upload->received);
+            outbox_send(out, out_gen, message);
+            
+            if (upload->received == upload->size) {
+                /* Once finished the slot belongs to transfer_lock, so
+                 * copy what we need first */
+                unsigned long done_id = upload->id;
+                long long done_size = upload->size;
+                int done_text = upload->text;
+                char done_name[XFER_NAME_LEN];
+                char done_room[ROOM_NAME_LEN];
+                char done_target[50];
+                strcpy(done_name, upload->name);
+                strcpy(done_room, upload->room);
+                strcpy(done_target, upload->target);
+                transfer_finish(upload);
+                upload = NULL;
+                
+                if (done_target[0]) {
+                    /* Long private message: stream it to the recipient only */
+                    Outbox *target_box;
+                    unsigned long target_gen;
+                    if (find_user_outbox(done_target, &target_box, &target_gen) &&
+                        start_stream(done_id, target_box, target_gen) > 0) {
+                        snprintf(message, sizeof(message), "[PM to %s]: (long message, %lld bytes)\n",
+                                 done_target, done_size);
+                        outbox_send(out, out_gen, message);
+                        snprintf(message, sizeof(message), "[PM] %s -> %s: (long message, %lld bytes)\n",
+                                 username, done_target, done_size);
+                        log_message(message);
+                    } else {
+                        char *not_delivered = "[Server]: User not found or busy - message not delivered\n";
+                        outbox_send(out, out_gen, not_delivered);
+                    }
+                    continue;
+                }
+                
+                char timestamp[20];
+                char text[BUFFER_SIZE];
+                get_timestamp(timestamp, sizeof(timestamp));
+                if (done_text) {
+                    snprintf(text, sizeof(text), "[Text] %s sent a long message (%lld bytes)\n",
+                             username, done_size);
+                } else {
+                    snprintf(text, sizeof(text), "[File] %s shared %s (%lld bytes) - /fetch %lu\n",
+                             username, done_name, done_size, done_id);
+                }
+                
+                /* If the sender has moved on, the old room gets it unsequenced */
+                if (current && strcmp(current->name, done_room) == 0) {
+                    broadcast_room_seq(current, timestamp, text, client_fd, message, sizeof(message));
+                } else {
+                    snprintf(message, sizeof(message), "%s [#%s] %s", timestamp, done_room, text);
+                    broadcast_room(message, client_fd, done_room);
+                }
+                printf("%s", message);
+                log_message(message);
+                
+                fanout_to_room(done_id, done_room, client_fd);
+            }
+        }
+        else if (strncmp(buffer, "/fetch ", 7) == 0) {
+            /* Download a shared file: /fetch <id> */
+            unsigned long id = strtoul(buffer + 7, NULL, 10);
+            
+            /* Only members of the room it was shared in (or the recipient of a
+             * private text) may fetch it */
+            pthread_mutex_lock(&lock);
+            char current_room[ROOM_NAME_LEN];
+            strcpy(current_room, clients[find_client(client_fd)].room);
+            pthread_mutex_unlock(&lock);
+            
+            int allowed = 0;
+            pthread_mutex_lock(&transfer_lock);
+            for (int i = 0; i < MAX_TRANSFERS; i++) {
+                if (transfers[i].in_use && transfers[i].complete && transfers[i].id == id) {
+                    allowed = transfers[i].target[0] ? strcmp(transfers[i].target, username) == 0
+                                                     : strcmp(transfers[i].room, current_room) == 0;
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&transfer_lock);
+            
+            int result = allowed ? start_stream(id, out, out_gen) : 0;
+            if (result == 0) {
+                char *missing = "[Server]: No such file in this room\n";
+                outbox_send(out, out_gen, missing);
+            } else if (result < 0) {
+                char *busy = "[Server]: That file is already downloading, or too many downloads are in progress\n";
+                outbox_send(out, out_gen, busy);
+            }
+        }
+        else if (strncmp(buffer, "/dlack ", 7) == 0) {
+            /* Download flow control: /dlack <id> <bytes received> */
+            unsigned long id;
+            long long received;
+            if (sscanf(buffer + 7, "%lu %lld", &id, &received) == 2) {
+                outbox_stream_update(out, out_gen, id, received, 0);
+            }
+        }
+        else if (strncmp(buffer, "/cancel ", 8) == 0) {
+            /* Client gave up on an upload or download: /cancel <id> */
+            unsigned long id = strtoul(buffer + 8, NULL, 10);
+            if (upload && upload->id == id) {
+                transfer_abort(upload);
+                upload = NULL;
+            } else {
+                outbox_stream_update(out, out_gen, id, 0, 1);
+            }
         }
         else if (strncmp(buffer, "/users", 6) == 0) {
             /* List users in current room */
             pthread_mutex_lock(&lock);
             char user_list[BUFFER_SIZE] = "[Server]: Users in this room: ";
             char current_room[ROOM_NAME_LEN];
-            strcpy(current_room, clients[client_index].room);
+            strcpy(current_room, clients[find_client(client_fd)].room);
             
             for (int i = 0; i < client_count; i++) {
                 if (strcmp(clients[i].room, current_room) == 0) {
@@ -457,7 +1637,7 @@ void *handle_client(void *arg) {
             }
             pthread_mutex_unlock(&lock);
             strcat(user_list, "\n");
-            send(client_fd, user_list, strlen(user_list), 0);
+            outbox_send(out, out_gen, user_list);
         }
         else if (strncmp(buffer, "/rooms", 6) == 0) {
             /* List all active rooms */
@@ -486,27 +1666,39 @@ void *handle_client(void *arg) {
             }
             pthread_mutex_unlock(&lock);
             strcat(room_list, "\n");
-            send(client_fd, room_list, strlen(room_list), 0);
+            outbox_send(out, out_gen, room_list);
         }
         else {
             /* Regular message - broadcast to room with timestamp */
             char timestamp[20];
             get_timestamp(timestamp, sizeof(timestamp));
             
-            pthread_mutex_lock(&lock);
-            char current_room[ROOM_NAME_LEN];
-            strcpy(current_room, clients[client_index].room);
-            pthread_mutex_unlock(&lock);
-            
-            snprintf(message, sizeof(message), "%s [#%s] %s", timestamp, current_room, buffer);
+            if (current) {
+                broadcast_room_seq(current, timestamp, buffer, client_fd, message, sizeof(message));
+            } else {
+                pthread_mutex_lock(&lock);
+                char current_room[ROOM_NAME_LEN];
+                strcpy(current_room, clients[find_client(client_fd)].room);
+                pthread_mutex_unlock(&lock);
+                
+                snprintf(message, sizeof(message), "%s [#%s] %s", timestamp, current_room, buffer);
+                broadcast_room(message, client_fd, current_room);
+            }
             
             printf("%s", message);
             log_message(message);
-            broadcast_room(message, client_fd, current_room);
         }
     }
 
     /* Client disconnected */
+    trace_record(conn_id, TRACE_CLOSE, NULL, 0);
+    if (upload) {
+        transfer_abort(upload);
+    }
+    if (current) {
+        room_leave(current, client_fd);
+    }
+    free(reader);
     pthread_mutex_lock(&lock);
     char leaving_user[50];
     char leaving_room[ROOM_NAME_LEN];
@@ -523,6 +1715,8 @@ void *handle_client(void *arg) {
     }
     pthread_mutex_unlock(&lock);
 
+    outbox_close(out);
+
     snprintf(message, sizeof(message), "[Server]: %s has left #%s\n", leaving_user, leaving_room);
     printf("%s", message);
     log_message(message);
@@ -532,20 +1726,52 @@ void *handle_client(void *arg) {
     return NULL;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
     int client_fd;
     struct sockaddr_in server_addr;
     pthread_t tid;
+    uint32_t next_conn_id = 1;
+
+    /* Optional: ./server -r <trace> records inbound traffic for replay.
+     * Passwords are replaced with TRACE_PASSWORD unless -k is given. */
+    const char *trace_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "-k") == 0) {
+            trace_keep_passwords = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-r trace_file [-k]]\n", argv[0]);
+            fprintf(stderr, "  -k   keep real passwords in the trace (default: \"%s\")\n", TRACE_PASSWORD);
+            exit(1);
+        }
+    }
+    if (trace_path) {
+        if (!trace_open(trace_path)) {
+            exit(1);
+        }
+        printf("Recording traffic trace to %s (passwords %s)\n", trace_path,
+               trace_keep_passwords ? "kept in plain text" : "replaced");
+    }
 
     /* Initialize mutex and open log file */
     pthread_mutex_init(&lock, NULL);
+    outbox_init_all();
+    room_table_init();
     log_file = fopen(LOG_FILE, "a");
     if (!log_file) {
         perror("Failed to open log file");
     }
 
+    /* Spool directory for file transfers */
+    if (mkdir(SPOOL_DIR, 0700) < 0 && errno != EEXIST) {
+        perror("Failed to create spool directory");
+    }
+    spool_clear();
+
     /* Setup signal handler for graceful shutdown (Ctrl+C) */
     signal(SIGINT, handle_shutdown);
+    signal(SIGPIPE, SIG_IGN);  // Disconnected peers surface as send() errors
 
     server_fd_global = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd_global < 0) {
@@ -589,15 +1815,31 @@ int main() {
             continue;
         }
 
+        uint32_t conn_id = next_conn_id++;
+        trace_record(conn_id, TRACE_CONNECT, NULL, 0);
+
+        /* Heap-allocate thread args so the next accept() can't overwrite them */
+        ClientArgs *args = malloc(sizeof(ClientArgs));
+        if (!args) {
+            perror("malloc failed");
+            close(client_fd);
+            trace_record(conn_id, TRACE_CLOSE, NULL, 0);
+            continue;
+        }
+        args->fd = client_fd;
+        args->conn_id = conn_id;
+
         pthread_mutex_lock(&lock);
         
         /* Check if server is full */
         if (client_count >= MAX_CLIENTS) {
             pthread_mutex_unlock(&lock);
+            free(args);
             char *full_msg = "Server full. Try again later.\n";
-            send(client_fd, full_msg, strlen(full_msg), 0);
+            send_all(client_fd, full_msg, strlen(full_msg));
             close(client_fd);
             printf("[Server]: Rejected client - server full\n");
+            trace_record(conn_id, TRACE_CLOSE, NULL, 0);
             continue;
         }
         
@@ -606,11 +1848,12 @@ int main() {
         memset(clients[client_count].password, 0, sizeof(clients[client_count].password));
         clients[client_count].authenticated = 0;
         strcpy(clients[client_count].room, "general");
+        clients[client_count].outbox = NULL;
         client_count++;
         
         pthread_mutex_unlock(&lock);
 
-        pthread_create(&tid, NULL, handle_client, &client_fd);
+        pthread_create(&tid, NULL, handle_client, args);
         pthread_detach(tid);  // Auto cleanup thread resources
     }
 
@@ -618,6 +1861,7 @@ int main() {
     if (log_file) {
         fclose(log_file);
     }
+    trace_close();
     pthread_mutex_destroy(&lock);
     return 0;
 }